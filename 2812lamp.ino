@@ -1,18 +1,24 @@
-#include <ClickEncoder.h>
-#include <TimerOne.h>
+// let the encoder and ADC interrupts run between pixels during show(),
+// FastLED drops the frame if one of them takes too long
+#define FASTLED_ALLOW_INTERRUPTS 1
 #include <FastLED.h>
 #include <EEPROMex.h>
+#include <avr/sleep.h>
 
 #include "globals.h"
 
-#define ENC_HALFSTEP 0
-
-#define MODE_COUNT 4
+#define MODE_COUNT 5
 
 #define LED_PIN 10
 #define COLOR_ORDER GRB
 #define CHIPSET WS2812
 
+// Number of strips the matrix columns are split over for parallel output,
+// 0 keeps a single FastLED controller on LED_PIN. Strips use consecutive
+// PORTB bits starting at PARALLEL_FIRST_BIT (bit 2 = pin 10).
+#define PARALLEL_STRIPS 0
+#define PARALLEL_FIRST_BIT 2
+
 #define PSU_MAX_MAMPS 2000 
 #define button_pin 5
 #define enup_pin 7
@@ -20,21 +26,47 @@
 
 #define petentiometer_pin A1
 
+#if defined(FRAME_STREAM) && defined(DEBUG_OUTPUT)
+#error "FRAME_STREAM and DEBUG_OUTPUT share the serial port, disable DEBUG_OUTPUT"
+#endif
+#if defined(FRAME_STREAM) && defined(KERNEL_BENCH)
+#error "FRAME_STREAM and KERNEL_BENCH share the serial port"
+#endif
+#define FRAME_STREAM_BAUD 1000000 // 630 byte frames at 60 fps need ~38 kB/s
+#define FRAME_STREAM_SEED 2812
+
 #define turnoffTimeout 3600000*5
 
+// how long to stay awake after blanking or a wake-up, so a double-click
+// can still switch the lamp back on before powering down
+#define sleepGraceTime 2000
+
 #include "ColorPalettes.h"
 #include "TorchMode.h"
+#include "LavaMode.h"
+#include "ParallelOutput.h"
+#include "EncoderInput.h"
+#include "BrightnessPot.h"
 
 CRGBPalette32 current_flame_palette = flame_palette_fire;
 
-ClickEncoder *encoder;
-int16_t last, value;
-
 byte brightness = 0;
 int brightTimer = 1;
 
 // encoder globals
 int last_encoder_position;
+int16_t accel_encoder_position;
+
+// input-to-photon latency: first encoder step of a change until the first
+// frame showing it has been sent, bucket n counts latencies < 2^n ms
+#define LATENCY_BUCKETS 8
+unsigned int latencyHistogram[LATENCY_BUCKETS];
+byte latency_pending = 0;
+unsigned long latency_start;
+// the histogram line takes ~60 ms at 9600 baud, so print it at most this often
+#define LATENCY_PRINT_MS 10000
+byte latency_unprinted = 0;
+unsigned long latencyPrintTime = 0;
 
 // controls state
 byte mode = 0;
@@ -44,46 +76,55 @@ int hold = 0;
 // 0: flame palette
 byte flame_palette = 0;
 byte flame_dissipation = 70;
+int flame_palette_steps = 0; // encoder steps towards the next palette
+
+// palette cross-fade
+#define PALETTE_FADE_ENTRIES 8 // palette entries blended per frame
+#define PALETTE_FADE_STEP 24   // max change of a color channel per visit
+
+CRGBPalette32 target_flame_palette;
+byte palette_target_dirty = 0;
+byte palette_fading = 0;
+byte palette_fade_pos = 0;
+byte palette_fade_changed = 0;
 
 // 1: static lamp
 byte lamp_hue = 1;
 byte lamp_saturation = 200;
 
-unsigned long time, renderTime, eepromTime, turnoffTime;
+unsigned long renderTime, eepromTime, turnoffTime;
 
 // enable/disable turnoff timer
 byte turnoffTimer = 0;
 
-void timerIsr()
+// strip is blanked, lamp waits to power down
+byte lampIdle = 0;
+unsigned long idleTime;
+
+void handleButton(ButtonEvent butt)
 {
-    encoder->service();
-    last_encoder_position = encoder->getValue();
-    ClickEncoder::Button butt = encoder->getButton(); 
-    if (butt != ClickEncoder::Open)
+    if (butt != ButtonOpen)
     {
         switch (butt)
         {
-        case ClickEncoder::Pressed:
-            break;
-        case ClickEncoder::Held:
+        case ButtonHeld:
             hold = 1;
+            flame_palette_steps = 0;
             break;
-        case ClickEncoder::Released:
+        case ButtonReleased:
             hold = 0;
+            flame_palette_steps = 0;
             break;
-        case ClickEncoder::Clicked:
+        case ButtonClicked:
             mode++;
             if (mode >= MODE_COUNT)
             {
                 mode = 0;
             }
             eepromTime = millis();
-            // reset torch
-            if (mode == 3) {
-                resetEnergy();
-            }
+            resetMode();
             break;
-        case ClickEncoder::DoubleClicked:
+        case ButtonDoubleClicked:
             if (turnoffTimer) {
                 turnoffTimer = 0;
             } else {
@@ -92,22 +133,47 @@ void timerIsr()
             }
             eepromTime = millis();
             break;
+        default:
+            break;
         }
     }
 }
 
+void resetMode()
+{
+    // a partial notch belongs to the previous mode
+    flame_palette_steps = 0;
+
+    // reset torch
+    if (mode == 3) {
+        resetEnergy();
+    }
+    if (mode == 4) {
+        resetLava();
+    }
+}
+
 void setup()
 {
     delay(500); // sanity delay
 
     FastLED.setMaxPowerInVoltsAndMilliamps(5, PSU_MAX_MAMPS);   // V, mA
 
+#if PARALLEL_STRIPS > 0
+    parallelBegin();
+#else
     FastLED.addLeds<CHIPSET, LED_PIN, COLOR_ORDER>(leds, NUM_LEDS).setCorrection(TypicalLEDStrip);
+#endif
     FastLED.setBrightness(brightness >> 2);
 
 #ifdef DEBUG_OUTPUT
     Serial.begin(9600);
 #endif
+#ifdef FRAME_STREAM
+    Serial.begin(FRAME_STREAM_BAUD);
+    random16_set_seed(FRAME_STREAM_SEED);
+    srand(FRAME_STREAM_SEED);
+#endif
 
     if (EEPROM_SETTINGS)
     {
@@ -121,42 +187,130 @@ void setup()
             read_eeprom();
         }
     }
+    loadFlamePaletteTarget();
+    current_flame_palette = target_flame_palette;
 
     pinMode(enup_pin, INPUT_PULLUP);
     pinMode(endown_pin, INPUT_PULLUP);
     pinMode(button_pin, INPUT);
     
-    encoder = new ClickEncoder(enup_pin, endown_pin, button_pin);
+    encoderBegin();
+    potBegin();
+    initSimGrid();
+    resetLava();
+    buildFlagBands();
 
-    Timer1.initialize(1000);
-    Timer1.attachInterrupt(timerIsr);
+#ifdef KERNEL_BENCH
+    runKernelBench();
+#endif
 
     if (turnoffTimer)
     {
         turnoffTime = millis();
     }
-
-    last = -1;
 }
 
 void loop()
 {
-    if (turnoffTimer && ((millis() - turnoffTime) < turnoffTimeout))
+    handleButton(buttonPoll());
+#ifdef FRAME_STREAM
+    frameStreamCommands();
+#endif
+
+    if (lampLit())
     {
+        lampIdle = 0;
         mainLoop();
     }
-    else if (turnoffTimer && ((millis() - turnoffTime) < (turnoffTimeout+10000))) {
+    else
+    {
+        idleLoop();
+    }
+}
+
+// whether the lamp should be rendering, otherwise it idles and powers down
+byte lampLit()
+{
+#ifdef FRAME_STREAM
+    // USART RX cannot wake the MCU from power-down, so the lamp stays lit
+    // for the capture rig: no turn-off timeout, no idling when switched off
+    turnoffTime = millis();
+    return 1;
+#else
+    return turnoffTimer && ((millis() - turnoffTime) < turnoffTimeout);
+#endif
+}
+
+void idleLoop()
+{
+    if (!lampIdle) {
         for (int i = 0; i < NUM_LEDS; i++) {
             leds[i] = CRGB(0, 0, 0);
         }
         FastLED.setBrightness(0);
-        FastLED.show();
+        showLeds();
+        // fade back in from 0 when mainLoop() resumes, after a wake-up or
+        // when switched on again within the grace time
+        brightness = 0;
+        brightTimer = 1;
+        lampIdle = 1;
+        idleTime = millis();
+    }
+
+    if (buttonDown || buttonClickPending || ((millis() - idleTime) < sleepGraceTime))
+    {
+        return;
+    }
+
+    powerDown();
+}
+
+// Sleeps in power-down until a pin-change interrupt from the encoder or the
+// button, then restores the settings and fades the brightness back in.
+void powerDown()
+{
+    if (eepromTime > 0)
+    {
+        eepromTime = 0;
+        if (EEPROM_SETTINGS)
+        {
+            write_eeprom();
+        }
+    }
+#ifdef DEBUG_OUTPUT
+    Serial.flush();
+#endif
+    potStop();
+
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    noInterrupts();
+    sleep_enable();
+#ifdef sleep_bod_disable
+    sleep_bod_disable();
+#endif
+    interrupts(); // the instruction after sei is always executed, so a pending wake-up is not lost
+    sleep_cpu();
+    sleep_disable();
+
+    potBegin();
+    if (EEPROM_SETTINGS)
+    {
+        read_eeprom();
     }
+    if (turnoffTimer)
+    {
+        turnoffTime = millis();
+        // the lamp is on again, the click that woke it must not change it;
+        // when switched off, the double-click that turns it on still counts
+        buttonSwallowGesture();
+    }
+    encoderRead(); // the wake-up turn only wakes the lamp
+    idleTime = millis();
 }
 
 void mainLoop()
 {
-    int newBrightness = analogRead(petentiometer_pin) >> 2;
+    int newBrightness = potBrightness;
     if (turnoffTimer && ((millis() - turnoffTime)>(turnoffTimeout-60000))) {
         newBrightness = newBrightness * ((turnoffTimeout - millis() + turnoffTime) / 60000);
     }
@@ -175,171 +329,387 @@ void mainLoop()
         FastLED.setBrightness(brightness);
     }
 
-    if ((value+last_encoder_position) != last )
+    last_encoder_position = encoderRead(&accel_encoder_position);
+    if (last_encoder_position != 0)
     {
-        value += last_encoder_position;
-        last = value;
         eepromTime = millis();
 
         switch (mode) {
             case 0:
-                if ((millis()-time)>430) {
-                    time = millis();
-                    if (hold)
+                if (hold)
+                {
+                    // the accelerated count only moves on a full notch
+                    if (accel_encoder_position != 0)
                     {
-                        flame_dissipation += last_encoder_position * 2;
-                        if (flame_dissipation < 1)
-                        {
-                            flame_dissipation = 1;
-                        }
+                        markInputEvent();
                     }
-                    else
+                    flame_dissipation = constrain(flame_dissipation + accel_encoder_position * 2, 1, 255);
+                }
+                else
+                {
+                    // one palette per notch, the fade hides the switch
+                    flame_palette_steps += last_encoder_position;
+                    while (flame_palette_steps >= ENCODER_STEPS_PER_NOTCH)
                     {
-                        if (last_encoder_position > 0)
-                        {
-                            flame_palette++;
-                        }
-                        if (last_encoder_position < 0)
-                        {
-                            if (flame_palette == 0)
-                            {
-                                flame_palette = gFlamePalettesCount;
-                            } else {
-                                flame_palette--;
-                            }
-                        }
+                        flame_palette_steps -= ENCODER_STEPS_PER_NOTCH;
+                        flame_palette++;
                         if (flame_palette > gFlamePalettesCount)
                         {
                             flame_palette = 0;
                         }
-
-                        if (flame_palette > 0)
+                        palette_target_dirty = 1;
+                        markInputEvent();
+                    }
+                    while (flame_palette_steps <= -ENCODER_STEPS_PER_NOTCH)
+                    {
+                        flame_palette_steps += ENCODER_STEPS_PER_NOTCH;
+                        if (flame_palette == 0)
                         {
-                            current_flame_palette = gFlamePalettes[flame_palette-1];
-                        }                    
+                            flame_palette = gFlamePalettesCount;
+                        } else {
+                            flame_palette--;
+                        }
+                        palette_target_dirty = 1;
+                        markInputEvent();
                     }
                 }
 
 #ifdef DEBUG_OUTPUT
-                Serial.print(" last_encoder_position: ");
+                Serial.print(F(" last_encoder_position: "));
                 Serial.print(last_encoder_position);
-                Serial.print(" hold: ");
+                Serial.print(F(" hold: "));
                 Serial.print(hold);
-                Serial.print("  Flame settings: ");
-                Serial.print("mode: ");
+                Serial.print(F("  Flame settings: "));
+                Serial.print(F("mode: "));
                 Serial.print(mode);
-                Serial.print("; dissipation: ");
+                Serial.print(F("; dissipation: "));
                 Serial.print(flame_dissipation);
-                Serial.print("; palette: ");
+                Serial.print(F("; palette: "));
                 //
                 Serial.print(flame_palette);
-                Serial.print("; brightness: ");
+                Serial.print(F("; brightness: "));
                 Serial.println(brightness);
 #endif
 
                 break;
             case 1:
+                if (accel_encoder_position != 0)
+                {
+                    markInputEvent();
+                }
                 if (hold)
                 {
-                    lamp_saturation += last_encoder_position * 8;
-                    if (lamp_saturation < 0)
-                    {
-                        lamp_saturation = 1;
-                    } else if (lamp_saturation>255)
-                    {
-                        lamp_saturation = 255;
-                    }
+                    lamp_saturation = constrain(lamp_saturation + accel_encoder_position * 8, 1, 255);
                 }
                 else
                 {
-                    lamp_hue += last_encoder_position * 8;
-                    if (lamp_hue < 0)
-                    {
-                        lamp_hue = 255 ;
-                    }
-                    else if (lamp_hue > 255)
-                    {
-                        lamp_hue = 0;
-                    }
+                    // hue wraps around
+                    lamp_hue += accel_encoder_position * 8;
                 }
 #ifdef DEBUG_OUTPUT
-                Serial.print(" last_encoder_position: ");
+                Serial.print(F(" last_encoder_position: "));
                 Serial.print(last_encoder_position);
-                Serial.print(" hold: ");
+                Serial.print(F(" hold: "));
                 Serial.print(hold);
-                Serial.print("Lamp settings: ");
-                Serial.print("mode: ");
+                Serial.print(F("Lamp settings: "));
+                Serial.print(F("mode: "));
                 Serial.print(mode);
-                Serial.print("; hue: ");
+                Serial.print(F("; hue: "));
                 Serial.print(lamp_hue);
-                Serial.print("; sat: ");
+                Serial.print(F("; sat: "));
                 Serial.print(lamp_saturation);
-                Serial.print("; brightness: ");
+                Serial.print(F("; brightness: "));
                 Serial.println(brightness);
 #endif
                 break;
         }
     }
 
+    // the solid color is redrawn every loop, the torch runs at 120 fps
+    unsigned long renderInterval = (mode == 1) ? 0 : (mode == 2) ? 5 : (1000 / FRAMES_PER_SECOND);
+    if ((millis() - renderTime) >= renderInterval) {
+        renderFrame();
+        renderTime = millis();
+    }
+
+#ifdef DEBUG_OUTPUT
+    if (latency_unprinted && (millis() - latencyPrintTime) >= LATENCY_PRINT_MS)
+    {
+        printLatency();
+    }
+#endif
+
+    eeprom_timer();
+}
+
+// render one frame of the current mode and send it to the strip
+void renderFrame()
+{
     switch (mode) {
         case 0:
-            if ((millis() - renderTime) >= (1000 / FRAMES_PER_SECOND)) {
-                Fire2012();
-                PutMatrix();
-                renderTime = millis();
-            }
+            Fire2012();
+            stepFlamePalette();
+            PutMatrix();
             break;
         case 1:
             fill_solid(leds, NUM_LEDS, CHSV(lamp_hue, lamp_saturation, brightness>>2));
-            FastLED.show();
             break;
         case 2:
-            if ((millis() - renderTime) >= 5) // 120 fps
+            torch();
+            break;
+        case 3:
+            IgniteFlagSparks();
+            ByFlag();
+            PutByMatrix();
+            break;
+        case 4:
+            lava();
+            stepFlamePalette();
+            PutMatrix();
+            break;
+    }
+    showLeds();
+}
+
+void showLeds()
+{
+    potPause();
+#if PARALLEL_STRIPS > 0
+    parallelShow();
+#else
+    FastLED.show();
+#endif
+    potResume();
+#ifdef FRAME_STREAM
+    frameStreamWrite();
+#endif
+
+    if (latency_pending)
+    {
+        latency_pending = 0;
+        recordLatency(micros() - latency_start);
+    }
+}
+
+#ifdef FRAME_STREAM
+// Frame stream
+// ============
+//
+// Every frame handed to the strip is written to the serial port as a binary
+// record, leds[] before brightness scaling:
+//   'L' 'F', frame number (uint32 LE), micros() at show (uint32 LE),
+//   NUM_LEDS * 3 bytes RGB in leds[] order
+// The host can pipe or memory-map the capture, and derives frames/s from the
+// timestamps. Parameters are scripted by sending four byte commands back:
+//   'C', command, value, command ^ value
+// A command with a wrong check byte is dropped and the parser resyncs on the
+// next 'C', so a lost byte costs one command instead of shifting all that
+// follow. Commands:
+//   'm' mode, 'p' flame palette, 'd' flame dissipation,
+//   't' torch spark_tfr, 'u' torch up_rad, 's' torch side_rad,
+//   'b' n: render n frames back to back, ignoring the frame interval,
+//   'B' n: the same without streaming the frames, i.e. pure render speed
+// A batch ends with an 'L' 'B' record: frame count (uint32 LE) and the
+// elapsed micros (uint32 LE), frames/s = count * 1000000 / elapsed. With 'b'
+// that includes sending the frames, which takes ~6.4 ms each at 1 Mbaud.
+
+uint32_t frameStreamCount = 0;
+byte frameStreamMuted = 0;
+uint8_t frameStreamCmd[4];
+uint8_t frameStreamCmdLen = 0;
+
+void frameStreamRecord(uint8_t tag, uint32_t a, uint32_t b)
+{
+    uint8_t header[10] = {'L', tag,
+                          (uint8_t)a, (uint8_t)(a >> 8), (uint8_t)(a >> 16), (uint8_t)(a >> 24),
+                          (uint8_t)b, (uint8_t)(b >> 8), (uint8_t)(b >> 16), (uint8_t)(b >> 24)};
+    Serial.write(header, sizeof(header));
+}
+
+void frameStreamWrite()
+{
+    if (frameStreamMuted)
+    {
+        return;
+    }
+    frameStreamRecord('F', frameStreamCount, micros());
+    Serial.write((const uint8_t *)leds, sizeof(leds));
+    frameStreamCount++;
+}
+
+void frameStreamBatch(byte frames, byte stream)
+{
+    frameStreamMuted = !stream;
+    uint32_t start = micros();
+    for (byte i = 0; i < frames; i++)
+    {
+        renderFrame();
+    }
+    uint32_t elapsed = micros() - start;
+    frameStreamMuted = 0;
+    frameStreamRecord('B', frames, elapsed);
+    renderTime = millis();
+}
+
+void frameStreamCommands()
+{
+    while (Serial.available())
+    {
+        uint8_t c = Serial.read();
+        if (frameStreamCmdLen == 0 && c != 'C')
+        {
+            continue;
+        }
+        frameStreamCmd[frameStreamCmdLen++] = c;
+        if (frameStreamCmdLen < sizeof(frameStreamCmd))
+        {
+            continue;
+        }
+        frameStreamCmdLen = 0;
+        if ((frameStreamCmd[1] ^ frameStreamCmd[2]) != frameStreamCmd[3])
+        {
+            // resync on the next 'C' already received
+            for (uint8_t i = 1; i < sizeof(frameStreamCmd); i++)
             {
-                torch();
-                FastLED.show();
-                renderTime = millis();
+                if (frameStreamCmd[i] == 'C')
+                {
+                    for (uint8_t j = i; j < sizeof(frameStreamCmd); j++)
+                    {
+                        frameStreamCmd[frameStreamCmdLen++] = frameStreamCmd[j];
+                    }
+                    break;
+                }
             }
+            continue;
+        }
+
+        char cmd = frameStreamCmd[1];
+        byte val = frameStreamCmd[2];
+        switch (cmd)
+        {
+        case 'm':
+            mode = val % MODE_COUNT;
+            resetMode();
             break;
-        case 3:
-            if ((millis() - renderTime) >= (1000 / FRAMES_PER_SECOND)) {
-                IgniteFlagSparks();
-                ByFlag();
-                PutByMatrix();
-                renderTime = millis();
+        case 'p':
+            if (val <= gFlamePalettesCount)
+            {
+                flame_palette = val;
+                palette_target_dirty = 1;
             }
             break;
+        case 'd':
+            flame_dissipation = val ? val : 1;
+            break;
+        case 't':
+            spark_tfr = val;
+            break;
+        case 'u':
+            up_rad = val;
+            break;
+        case 's':
+            side_rad = val;
+            break;
+        case 'b':
+            frameStreamBatch(val, 1);
+            break;
+        case 'B':
+            frameStreamBatch(val, 0);
+            break;
+        }
+    }
+}
+#endif
+
+void markInputEvent()
+{
+    if (!latency_pending)
+    {
+        latency_pending = 1;
+        latency_start = encoderEventTime;
     }
+}
 
-    eeprom_timer();
+void recordLatency(unsigned long us)
+{
+    unsigned long ms = us >> 10;
+    byte bucket = 0;
+    while (ms && bucket < LATENCY_BUCKETS - 1)
+    {
+        ms >>= 1;
+        bucket++;
+    }
+    if (latencyHistogram[bucket] < 65535)
+    {
+        latencyHistogram[bucket]++;
+    }
+    latency_unprinted = 1;
+}
+
+void printLatency()
+{
+    Serial.print(F(" latency histogram (<1,2,4..64,more ms):"));
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        Serial.print(' ');
+        Serial.print(latencyHistogram[i]);
+    }
+    Serial.println();
+    latency_unprinted = 0;
+    latencyPrintTime = millis();
 }
 
 #define SPARKING 130
 void Fire2012() 
 {
-    // Step 1.  Cool down every cell a little
-    for (int j = 0; j < NUM_COLS; j++)
+    fireCool();
+    fireDrift();
+    fireSpark();
+}
+
+// Step 1.  Cool down every cell a little
+void fireCool()
+{
+    // fewer simulated rows cool harder per cell, which passes 255 on a
+    // reduced grid at high dissipation
+    int cooling = ((flame_dissipation * 10) / SIM_ROWS) + 2;
+    if (cooling > 255)
     {
-        for (int i = 0; i < NUM_ROWS; i++)
+        cooling = 255;
+    }
+    for (int j = 0; j < SIM_COLS; j++)
+    {
+        for (int i = 0; i < SIM_ROWS; i++)
         {
-            matrix[i][j] = qsub8(matrix[i][j], random8(0, ((flame_dissipation * 10) / NUM_ROWS) + 2));
+            matrix[i][j] = qsub8(matrix[i][j], random8(0, cooling));
         }
     }
+}
 
-    // Step 2.  Heat from each cell drifts 'up' and diffuses a little
-    for (int j = 0; j < NUM_COLS; j++)
+// Step 2.  Heat from each cell drifts 'up' and diffuses a little
+// Columns are independent, so sweep whole rows top-down: same result as
+// the per-column walk, but the row pointers are computed once per row.
+void fireDrift()
+{
+    for (int k = SIM_ROWS - 1; k > 2; k--)
     {
-        for (int k = NUM_ROWS - 1; k > 2; k--)
+        byte *dst = matrix[k];
+        const byte *below = matrix[k - 1];
+        const byte *below2 = matrix[k - 2];
+        for (int j = 0; j < SIM_COLS; j++)
         {
-            matrix[k][j] = (matrix[k - 1][j] + matrix[k - 2][j] + matrix[k - 2][j]) / 3;
+            dst[j] = (below[j] + below2[j] + below2[j]) / 3;
         }
     }
+}
 
-    // Step 3.  Randomly ignite new 'sparks' of heat near the bottom
-    for (int j = 0; j < NUM_COLS; j++)
+// Step 3.  Randomly ignite new 'sparks' of heat near the bottom
+void fireSpark()
+{
+    for (int j = 0; j < SIM_COLS; j++)
     {
         if (random8() < SPARKING) {
-            int y = random8(7);
+            int y = random8((7 + SIM_SCALE - 1) / SIM_SCALE);
             matrix[y][j] = qadd8(matrix[y][j], random8(160, 255));
         }
     }
@@ -347,28 +717,19 @@ void Fire2012()
 
 void ByFlag()
 {
-    for (int x = 0; x < NUM_COLS; x++)
+    // Rows are independent; only the last column wraps around to column 0
+    // (which has already been averaged), so peel it off the inner loop.
+    for (int i = 0; i < NUM_ROWS; i++)
     {
-        for (int i = 0; i < NUM_ROWS; i++)
+        byte *row = matrix[i];
+        for (int x = 0; x < NUM_COLS - 1; x++)
         {
-            matrix[i][x] = avg8(matrix[i][x], matrix[i][normalizeX(x + 1)]);
+            row[x] = avg8(row[x], row[x + 1]);
         }
+        row[NUM_COLS - 1] = avg8(row[NUM_COLS - 1], row[0]);
     }
 }
 
-int normalizeX(int x)
-{
-    if (x < 0)
-    {
-        return NUM_COLS - 1;
-    }
-    if (x >= NUM_COLS)
-    {
-        return 0;
-    }
-    return x;
-}
-
 void IgniteFlagSparks()
 {
     for (int curCol = 0; curCol < NUM_COLS; curCol++)
@@ -387,6 +748,75 @@ void IgniteFlagSparks()
     }
 }
 
+void loadFlamePaletteTarget()
+{
+    if (flame_palette > 0)
+    {
+        target_flame_palette = gFlamePalettes[flame_palette - 1];
+    }
+    else
+    {
+        // palette 0 renders through nonlinearEnergy(), fade towards a sampled copy of it
+        for (int i = 0; i < 32; i++)
+        {
+            target_flame_palette[i] = nonlinearEnergy(i << 3);
+        }
+    }
+}
+
+byte fadeChannel(byte &c, byte t)
+{
+    if (c < t)
+    {
+        c = (t - c > PALETTE_FADE_STEP) ? c + PALETTE_FADE_STEP : t;
+        return 1;
+    }
+    if (c > t)
+    {
+        c = (c - t > PALETTE_FADE_STEP) ? c - PALETTE_FADE_STEP : t;
+        return 1;
+    }
+    return 0;
+}
+
+// Moves current_flame_palette towards the selected palette, a fixed number of
+// entries per frame. A new selection is only decompressed here, once per frame
+// at most, never in the input path.
+void stepFlamePalette()
+{
+    if (palette_target_dirty)
+    {
+        palette_target_dirty = 0;
+        loadFlamePaletteTarget();
+        palette_fading = 1;
+        palette_fade_pos = 0;
+        palette_fade_changed = 0;
+        // blend right away, so the frame after the input already shows it
+    }
+    if (!palette_fading)
+    {
+        return;
+    }
+    for (int n = 0; n < PALETTE_FADE_ENTRIES; n++)
+    {
+        CRGB &c = current_flame_palette[palette_fade_pos];
+        const CRGB &t = target_flame_palette[palette_fade_pos];
+        palette_fade_changed |= fadeChannel(c.r, t.r);
+        palette_fade_changed |= fadeChannel(c.g, t.g);
+        palette_fade_changed |= fadeChannel(c.b, t.b);
+        if (++palette_fade_pos == 32)
+        {
+            palette_fade_pos = 0;
+            if (!palette_fade_changed)
+            {
+                palette_fading = 0;
+                return;
+            }
+            palette_fade_changed = 0;
+        }
+    }
+}
+
 void PutMatrix()
 {
     int i = 0;
@@ -396,11 +826,11 @@ void PutMatrix()
         for (int r = 0; r < NUM_ROWS; r++)
         {
             if ( (c % 2) == 0 ) {
-                pixel = matrix[r][c];
+                pixel = sampleMatrix(r, c);
             } else {
-                pixel = matrix[(NUM_ROWS-1)-r][c];
+                pixel = sampleMatrix((NUM_ROWS-1)-r, c);
             }
-            if (flame_palette > 0 )
+            if (flame_palette > 0 || mode == 4 || palette_fading)
             {
                 leds[i] = ColorFromPalette(current_flame_palette,pixel);
             } else {
@@ -409,39 +839,71 @@ void PutMatrix()
             i++;
         }
     }
-    FastLED.show();
+}
+
+// Flag bands, bottom row first. A band with sat 0 is plain white scaled
+// linearly by the heat, any other band is CHSV(hue, sat, heat).
+struct FlagBand
+{
+    byte rows;
+    byte hue;
+    byte sat;
+};
+
+const FlagBand flagBands[] = {
+    {NUM_ROWS / 3, 0, 0},
+    {NUM_ROWS / 3, 4, 247},
+    {NUM_ROWS - 2 * (NUM_ROWS / 3), 0, 0},
+};
+#define FLAG_BAND_COUNT (sizeof(flagBands) / sizeof(FlagBand))
+
+CRGB flagBandColor[FLAG_BAND_COUNT]; // band color at full value
+byte flagBandDim[FLAG_BAND_COUNT];   // 1: value goes through the hsv2rgb dimming curve
+byte flagRowBand[NUM_ROWS];
+
+// CHSV(h, s, v) converts to the full value color scaled by
+// scale8_video(v, v), so each band only needs its color at v = 255.
+void buildFlagBands()
+{
+    byte row = 0;
+    for (byte b = 0; b < FLAG_BAND_COUNT; b++)
+    {
+        if (flagBands[b].sat == 0)
+        {
+            flagBandColor[b] = CRGB(255, 255, 255);
+            flagBandDim[b] = 0;
+        }
+        else
+        {
+            flagBandColor[b] = CHSV(flagBands[b].hue, flagBands[b].sat, 255);
+            flagBandDim[b] = 1;
+        }
+        for (byte n = 0; n < flagBands[b].rows && row < NUM_ROWS; n++)
+        {
+            flagRowBand[row++] = b;
+        }
+    }
+    while (row < NUM_ROWS)
+    {
+        flagRowBand[row++] = FLAG_BAND_COUNT - 1;
+    }
 }
 
 void PutByMatrix()
 {
     int i = 0;
-    int border = (int) NUM_ROWS / 3;
-    int pixel;
     for (int c = 0; c < NUM_COLS; c++)
     {
         for (int r = 0; r < NUM_ROWS; r++)
         {
-            if ((c % 2) == 0)
-            {
-                pixel = matrix[r][c];
-            }
-            else
-            {
-                pixel = matrix[(NUM_ROWS - 1) - r][c];
-            }
-
-            if (r >= (border*2) || r < border) 
-            {
-                leds[i] = CRGB(pixel, pixel, pixel);
-            }
-            else
-            {
-                leds[i] = CHSV(4, 247, pixel); //CRGB(pixel,0,0)
-            }
+            int y = ((c % 2) == 0) ? r : (NUM_ROWS - 1) - r;
+            byte pixel = matrix[y][c];
+            byte b = flagRowBand[y];
+            leds[i] = flagBandColor[b];
+            leds[i].nscale8(flagBandDim[b] ? scale8_video(pixel, pixel) : pixel);
             i++;
         }
     }
-    FastLED.show();
 }
 
 
@@ -490,3 +952,153 @@ CRGB nonlinearEnergy( byte energy )
     return CRGB(r, g, b);
 }
 
+#ifdef KERNEL_BENCH
+// Kernel microbenchmarks
+// ======================
+//
+// Times every hot rendering function in isolation: BENCH_WARMUP untimed
+// samples, then BENCH_SAMPLES timed ones of BENCH_INNER calls each, so the
+// 4 us micros() resolution stays small against a sample. Median and p99 per
+// call are printed as one JSON object per kernel, with the rows and columns
+// it works on: the simulated grid for the simulations, the full LED matrix
+// for the mapping and flag kernels. That way runs of two builds, e.g. with
+// different SIM_SCALE, can be diffed. Timer0 keeps running, the median is
+// what to compare.
+
+#define BENCH_WARMUP 4
+#define BENCH_SAMPLES 31
+#define BENCH_INNER 8
+
+volatile byte bench_sink;
+byte bench_count = 0;
+
+void benchKernel(const __FlashStringHelper *name, void (*kernel)(), byte rows, byte cols)
+{
+    uint32_t samples[BENCH_SAMPLES];
+    for (int s = -BENCH_WARMUP; s < BENCH_SAMPLES; s++)
+    {
+        unsigned long start = micros();
+        for (int i = 0; i < BENCH_INNER; i++)
+        {
+            kernel();
+        }
+        unsigned long t = micros() - start;
+        if (s >= 0)
+        {
+            samples[s] = t;
+        }
+    }
+
+    // insertion sort, 31 entries
+    for (int i = 1; i < BENCH_SAMPLES; i++)
+    {
+        uint32_t v = samples[i];
+        int j = i - 1;
+        while (j >= 0 && samples[j] > v)
+        {
+            samples[j + 1] = samples[j];
+            j--;
+        }
+        samples[j + 1] = v;
+    }
+    uint32_t median = samples[BENCH_SAMPLES / 2] * 1000 / BENCH_INNER;
+    uint32_t p99 = samples[(BENCH_SAMPLES * 99 + 99) / 100 - 1] * 1000 / BENCH_INNER;
+
+    if (bench_count++)
+    {
+        Serial.print(F(",\n"));
+    }
+    Serial.print(F("  {\"kernel\": \""));
+    Serial.print(name);
+    Serial.print(F("\", \"rows\": "));
+    Serial.print(rows);
+    Serial.print(F(", \"cols\": "));
+    Serial.print(cols);
+    Serial.print(F(", \"median_ns\": "));
+    Serial.print(median);
+    Serial.print(F(", \"p99_ns\": "));
+    Serial.print(p99);
+    Serial.print(F("}"));
+}
+
+void benchGetEnergyBitMode()
+{
+    byte sum = 0;
+    for (byte y = 0; y < SIM_ROWS; y++)
+        for (byte x = 0; x < SIM_COLS; x++)
+            sum += getEnergyBitMode(y, x);
+    bench_sink = sum;
+}
+
+void benchPutEnergyBitMode()
+{
+    for (byte y = 0; y < SIM_ROWS; y++)
+        for (byte x = 0; x < SIM_COLS; x++)
+            putEnergyBitMode(y, x, (x + y) & 3);
+}
+
+void runKernelBench()
+{
+    byte saved_mode = mode;
+    byte saved_palette = flame_palette;
+
+#ifndef DEBUG_OUTPUT
+    Serial.begin(9600);
+#endif
+    Serial.print(F("{\"sim_rows\": "));
+    Serial.print(SIM_ROWS);
+    Serial.print(F(", \"sim_cols\": "));
+    Serial.print(SIM_COLS);
+    Serial.print(F(", \"leds\": "));
+    Serial.print(NUM_LEDS);
+    Serial.println(F(", \"results\": ["));
+
+    // fire: let the heat field settle first
+    mode = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        Fire2012();
+    }
+    benchKernel(F("fire_cool"), fireCool, SIM_ROWS, SIM_COLS);
+    benchKernel(F("fire_drift"), fireDrift, SIM_ROWS, SIM_COLS);
+    benchKernel(F("fire_spark"), fireSpark, SIM_ROWS, SIM_COLS);
+    flame_palette = 1;
+    palette_fading = 0;
+    current_flame_palette = gFlamePalettes[0];
+    benchKernel(F("put_matrix_palette"), PutMatrix, NUM_ROWS, NUM_COLS);
+    flame_palette = 0;
+    benchKernel(F("put_matrix_nonlinear"), PutMatrix, NUM_ROWS, NUM_COLS);
+
+    // torch
+    resetEnergy();
+    for (int i = 0; i < 100; i++)
+    {
+        torch();
+    }
+    benchKernel(F("inject_random"), injectRandom, SIM_ROWS, SIM_COLS);
+    benchKernel(F("calc_next_energy"), calcNextEnergy, SIM_ROWS, SIM_COLS);
+    benchKernel(F("calc_next_colors"), calcNextColors, NUM_ROWS, NUM_COLS);
+    benchKernel(F("get_energy_bit_mode"), benchGetEnergyBitMode, SIM_ROWS, SIM_COLS);
+    benchKernel(F("put_energy_bit_mode"), benchPutEnergyBitMode, SIM_ROWS, SIM_COLS);
+
+    // flag
+    resetEnergy();
+    benchKernel(F("ignite_flag_sparks"), IgniteFlagSparks, NUM_ROWS, NUM_COLS);
+    benchKernel(F("by_flag"), ByFlag, NUM_ROWS, NUM_COLS);
+    benchKernel(F("put_by_matrix"), PutByMatrix, NUM_ROWS, NUM_COLS);
+
+    // lava
+    mode = 4;
+    resetLava();
+    benchKernel(F("lava"), lava, SIM_ROWS, SIM_COLS);
+
+    Serial.println(F("\n]}"));
+
+    mode = saved_mode;
+    flame_palette = saved_palette;
+    loadFlamePaletteTarget();
+    current_flame_palette = target_flame_palette;
+    resetEnergy();
+    resetLava();
+}
+#endif
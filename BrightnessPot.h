@@ -0,0 +1,75 @@
+#ifndef __have__lampBrightnessPot_h__
+#define __have__lampBrightnessPot_h__
+
+// Brightness potentiometer
+// ========================
+//
+// The ADC converts the potentiometer in the background, auto-triggered by
+// the Timer0 overflow that already drives millis() (~976 Hz), and the ISR
+// averages POT_SAMPLES conversions into potBrightness with a hysteresis band
+// around the current step, so the main loop just reads a byte.
+
+#include <Arduino.h>
+
+#define POT_SAMPLES_SHIFT 4 // 16 conversions per result, ~61 updates/s
+#define POT_HYSTERESIS 2    // in 10-bit ADC steps beyond the current 8-bit step
+
+volatile byte potBrightness = 0;
+
+uint16_t potSum = 0;
+uint8_t potCount = 0;
+
+ISR(ADC_vect)
+{
+    potSum += ADC;
+    if (++potCount < (1 << POT_SAMPLES_SHIFT))
+    {
+        return;
+    }
+    int16_t avg = potSum >> POT_SAMPLES_SHIFT; // 0..1023
+    potSum = 0;
+    potCount = 0;
+
+    int16_t stepLow = ((int16_t)potBrightness << 2) - POT_HYSTERESIS;
+    int16_t stepHigh = ((int16_t)potBrightness << 2) + 3 + POT_HYSTERESIS;
+    if (avg < stepLow || avg > stepHigh)
+    {
+        potBrightness = avg >> 2;
+    }
+}
+
+void potBegin()
+{
+    potSum = 0;
+    potCount = 0;
+    ADMUX = _BV(REFS0) | ((petentiometer_pin - A0) & 0x07); // AVcc reference
+
+    // one conversion right away, so the fade-in after boot or wake-up has
+    // a target before the first averaged result arrives
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+    while (ADCSRA & _BV(ADSC))
+        ;
+    potBrightness = ADC >> 2;
+
+    ADCSRB = _BV(ADTS2); // trigger: Timer0 overflow
+    ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+}
+
+// stop triggering new conversions, e.g. while the strip is being clocked out
+inline void potPause()
+{
+    ADCSRA &= ~_BV(ADATE);
+}
+
+inline void potResume()
+{
+    ADCSRA |= _BV(ADATE);
+}
+
+// switch the ADC off completely, potBegin() brings it back
+inline void potStop()
+{
+    ADCSRA = 0;
+}
+
+#endif
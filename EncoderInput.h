@@ -0,0 +1,235 @@
+#ifndef __have__lampEncoderInput_h__
+#define __have__lampEncoderInput_h__
+
+// Encoder and button input
+// ========================
+//
+// Edge driven replacement for polling ClickEncoder from a 1 kHz timer. The
+// encoder and button pins raise pin-change interrupts; the ISR decodes the
+// quadrature signal with a transition table and timestamps button edges.
+// Hold and click/double-click timeouts are resolved from those timestamps
+// in buttonPoll(), so nothing runs while the knob is left alone.
+//
+// Next to the raw step count the ISR keeps an accelerated one, where
+// detents that follow each other quickly count two or four times, and the
+// time of the first step not yet read, for input latency measurements. The
+// speed is taken once per ENCODER_STEPS_PER_NOTCH transitions: within a
+// detent the transitions come in bursts far shorter than any hand turn, so
+// timing single transitions would accelerate even slow rotation. The
+// accelerated count therefore only moves in whole notches.
+//
+// Edges are only seen while interrupts are enabled. Both output paths open
+// a window between pixels (FASTLED_ALLOW_INTERRUPTS for the single strip,
+// parallelShow() for PARALLEL_STRIPS > 0), so show() delays the ISR by at
+// most one pixel instead of collapsing a whole frame's worth of edges.
+//
+// All three inputs must be on PORTD (Arduino pins 0..7), which maps pin n
+// to PCINT16+n, i.e. bit n of PCMSK2 and PIND.
+
+#include <Arduino.h>
+
+#define ENCODER_STEPS_PER_NOTCH 4 // quadrature transitions per detent
+#define ENCODER_ACCEL_FAST_MS 30 // notches closer than this count four times
+#define ENCODER_ACCEL_MS 80      // notches closer than this count twice
+#define BUTTON_DEBOUNCE_MS 10
+#define BUTTON_HOLD_MS 1200
+#define BUTTON_DOUBLECLICK_MS 600
+
+enum ButtonEvent
+{
+    ButtonOpen = 0,      // nothing happened
+    ButtonHeld,          // pressed for BUTTON_HOLD_MS
+    ButtonReleased,      // released after being held
+    ButtonClicked,       // short press, no second one within BUTTON_DOUBLECLICK_MS
+    ButtonDoubleClicked, // two short presses
+};
+
+// indexed by (previous AB << 2) | current AB, A and B active low;
+// no change and invalid (skipped) transitions count 0
+const int8_t encoderStepTable[16] = {0, 1, -1, 0, -1, 0, 0, 1, 1, 0, 0, -1, 0, -1, 1, 0};
+
+volatile int16_t encoderDelta = 0;
+volatile int16_t encoderAccelDelta = 0;
+volatile uint8_t encoderAB = 0;
+volatile uint8_t encoderPending = 0;
+volatile int8_t encoderNotchSteps = 0;        // transitions into the current notch
+volatile unsigned long encoderNotchTime = 0;  // millis() of the last full notch
+volatile unsigned long encoderEventMicros = 0; // micros() of the first unread step
+
+unsigned long encoderEventTime = 0; // micros() of the first step returned by encoderRead()
+
+volatile uint8_t buttonDown = 0;
+volatile uint8_t buttonHeld = 0;
+volatile uint8_t buttonClickPending = 0;
+volatile uint8_t buttonEvent = ButtonOpen;
+volatile unsigned long buttonEdgeTime = 0; // last accepted edge, for debounce
+volatile unsigned long buttonPressTime = 0;
+volatile unsigned long buttonClickTime = 0;
+volatile uint8_t buttonSwallow = 0;          // dropping the wake-up gesture
+volatile unsigned long buttonSwallowTime = 0; // last release while dropping
+
+inline uint8_t readEncoderAB()
+{
+    uint8_t pins = PIND;
+    return ((pins & _BV(enup_pin)) ? 0 : 2) | ((pins & _BV(endown_pin)) ? 0 : 1);
+}
+
+inline uint8_t readButton()
+{
+    return (PIND & _BV(button_pin)) ? 0 : 1;
+}
+
+// debounced button edge, called with interrupts off
+void buttonEdge(uint8_t down, unsigned long now)
+{
+    buttonEdgeTime = now;
+    buttonDown = down;
+    if (buttonSwallow)
+    {
+        if (!down)
+        {
+            buttonSwallowTime = now;
+        }
+    }
+    else if (down)
+    {
+        buttonPressTime = now;
+        buttonHeld = 0;
+    }
+    else if (buttonHeld)
+    {
+        buttonEvent = ButtonReleased;
+    }
+    else if (buttonClickPending)
+    {
+        buttonClickPending = 0;
+        buttonEvent = ButtonDoubleClicked;
+    }
+    else
+    {
+        buttonClickPending = 1;
+        buttonClickTime = now;
+    }
+}
+
+ISR(PCINT2_vect)
+{
+    unsigned long now = millis();
+
+    uint8_t ab = readEncoderAB();
+    int8_t step = encoderStepTable[(encoderAB << 2) | ab];
+    encoderAB = ab;
+    if (step)
+    {
+        if (!encoderPending)
+        {
+            encoderPending = 1;
+            encoderEventMicros = micros();
+        }
+        encoderDelta += step;
+        encoderNotchSteps += step;
+        if (encoderNotchSteps == ENCODER_STEPS_PER_NOTCH || encoderNotchSteps == -ENCODER_STEPS_PER_NOTCH)
+        {
+            int8_t notch = encoderNotchSteps;
+            encoderNotchSteps = 0;
+            unsigned long dt = now - encoderNotchTime;
+            encoderNotchTime = now;
+            if (dt < ENCODER_ACCEL_FAST_MS)
+                encoderAccelDelta += notch * 4;
+            else if (dt < ENCODER_ACCEL_MS)
+                encoderAccelDelta += notch * 2;
+            else
+                encoderAccelDelta += notch;
+        }
+    }
+
+    uint8_t down = readButton();
+    if (down != buttonDown && (now - buttonEdgeTime) >= BUTTON_DEBOUNCE_MS)
+    {
+        buttonEdge(down, now);
+    }
+}
+
+void encoderBegin()
+{
+    encoderAB = readEncoderAB();
+    buttonDown = readButton();
+
+    PCMSK2 |= _BV(enup_pin) | _BV(endown_pin) | _BV(button_pin);
+    PCIFR = _BV(PCIF2);
+    PCICR |= _BV(PCIE2);
+}
+
+// encoder steps since the last call, optionally also the accelerated count
+// Drops the button gesture that woke the lamp: everything up to the first
+// release followed by BUTTON_DOUBLECLICK_MS without a press, so neither a
+// click nor a double-click on wake-up turns into an event.
+void buttonSwallowGesture()
+{
+    noInterrupts();
+    buttonEvent = ButtonOpen;
+    buttonClickPending = 0;
+    buttonHeld = 0;
+    buttonSwallow = 1;
+    buttonSwallowTime = millis();
+    interrupts();
+}
+
+int16_t encoderRead(int16_t *accelerated = 0)
+{
+    noInterrupts();
+    int16_t d = encoderDelta;
+    encoderDelta = 0;
+    if (accelerated)
+    {
+        *accelerated = encoderAccelDelta;
+    }
+    encoderAccelDelta = 0;
+    encoderEventTime = encoderEventMicros;
+    encoderPending = 0;
+    interrupts();
+    return d;
+}
+
+ButtonEvent buttonPoll()
+{
+    ButtonEvent e = ButtonOpen;
+    unsigned long now = millis();
+
+    noInterrupts();
+    // the last bounce may have been swallowed by the debounce window
+    uint8_t down = readButton();
+    if (down != buttonDown && (now - buttonEdgeTime) >= BUTTON_DEBOUNCE_MS)
+    {
+        buttonEdge(down, now);
+    }
+
+    if (buttonSwallow)
+    {
+        if (!buttonDown && (now - buttonSwallowTime) >= BUTTON_DOUBLECLICK_MS)
+        {
+            buttonSwallow = 0;
+        }
+    }
+    else if (buttonEvent != ButtonOpen)
+    {
+        e = (ButtonEvent)buttonEvent;
+        buttonEvent = ButtonOpen;
+    }
+    else if (buttonDown && !buttonHeld && (now - buttonPressTime) >= BUTTON_HOLD_MS)
+    {
+        buttonHeld = 1;
+        buttonClickPending = 0;
+        e = ButtonHeld;
+    }
+    else if (buttonClickPending && !buttonDown && (now - buttonClickTime) >= BUTTON_DOUBLECLICK_MS)
+    {
+        buttonClickPending = 0;
+        e = ButtonClicked;
+    }
+    interrupts();
+
+    return e;
+}
+
+#endif
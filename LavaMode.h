@@ -0,0 +1,129 @@
+#ifndef __have__lampLavaMode_h__
+#define __have__lampLavaMode_h__
+
+// lava mode
+// =========
+//
+// Two octaves of 8 bit value noise sampled on the cylinder formed by the
+// columns (x wraps around), with time as the z axis. The lattice values of
+// the two z-slices around the current time are kept between frames and only
+// refilled when z crosses a slice; each frame blends them once per lattice
+// point and then bilinearly interpolates per cell, using column/row lattice
+// positions computed once in resetLava(). The result goes into the SIM_ROWS x
+// SIM_COLS grid of matrix[] and is mapped through the flame palette by
+// PutMatrix().
+//
+// The lattices live in the torch's nextEnergy[] buffer, which is only scratch
+// space within a single torch() call.
+//
+// KERNEL_BENCH reports the cost of one frame as the "lava" kernel.
+
+#include "globals.h"
+#include <FastLED.h>
+
+#define LAVA_CELLS_X 4 // lattice cells around the cylinder, first octave
+#define LAVA_CELLS_Y 2 // lattice cells over the height, first octave
+#define LAVA_SPEED 6   // z advance per frame, 1/256 of a lattice cell
+
+#define LAVA_POINTS0 ((LAVA_CELLS_Y + 1) * LAVA_CELLS_X)
+#define LAVA_POINTS1 ((2 * LAVA_CELLS_Y + 1) * 2 * LAVA_CELLS_X)
+
+struct LavaLattice
+{
+    byte slice[2][LAVA_POINTS0 + LAVA_POINTS1]; // lattice at floor(z) and floor(z) + 1
+    byte current[LAVA_POINTS0 + LAVA_POINTS1];  // blended to z for this frame
+};
+
+static_assert(sizeof(LavaLattice) <= sizeof(nextEnergy), "lava lattice does not fit into nextEnergy");
+
+LavaLattice &lavaLattice = *(LavaLattice *)nextEnergy;
+
+uint16_t lavaColPos[SIM_COLS]; // 8.8 lattice x of each column, first octave
+uint16_t lavaRowPos[SIM_ROWS]; // 8.8 lattice y of each row, first octave
+uint16_t lavaZ = 0;            // 8.8 time
+
+inline byte lavaHash(byte x, byte y, uint16_t z, byte octave)
+{
+    uint16_t h = (uint16_t)(x + 37u * y + 101u * octave) * 2053u + z * 13849u;
+    h ^= h >> 7;
+    h *= 0x2f1b;
+    h ^= h >> 9;
+    return h >> 8;
+}
+
+void fillLavaSlice(byte *slice, uint16_t z)
+{
+    for (byte y = 0; y <= LAVA_CELLS_Y; y++)
+        for (byte x = 0; x < LAVA_CELLS_X; x++)
+            *slice++ = lavaHash(x, y, z, 0);
+    for (byte y = 0; y <= 2 * LAVA_CELLS_Y; y++)
+        for (byte x = 0; x < 2 * LAVA_CELLS_X; x++)
+            *slice++ = lavaHash(x, y, z, 1);
+}
+
+void resetLava()
+{
+    for (byte c = 0; c < SIM_COLS; c++)
+    {
+        lavaColPos[c] = ((uint32_t)c * (LAVA_CELLS_X << 8)) / SIM_COLS;
+    }
+    for (byte r = 0; r < SIM_ROWS; r++)
+    {
+        lavaRowPos[r] = ((uint32_t)r * (LAVA_CELLS_Y << 8)) / SIM_ROWS;
+    }
+    lavaZ = 0;
+    fillLavaSlice(lavaLattice.slice[0], 0);
+    fillLavaSlice(lavaLattice.slice[1], 1);
+}
+
+// bilinear lookup between lattice row row0 and the one below it, x wraps around
+inline byte lavaSample(byte width, uint16_t xpos, const byte *row0, byte yf)
+{
+    byte xi = xpos >> 8;
+    byte xf = xpos & 0xff;
+    byte xn = (xi + 1 == width) ? 0 : xi + 1;
+    const byte *row1 = row0 + width;
+    byte top = lerp8by8(row0[xi], row0[xn], xf);
+    byte bottom = lerp8by8(row1[xi], row1[xn], xf);
+    return lerp8by8(top, bottom, yf);
+}
+
+void lava()
+{
+    // advance time, refill the upper slice when z crosses a lattice plane
+    uint16_t z = lavaZ + LAVA_SPEED;
+    if ((z >> 8) != (lavaZ >> 8))
+    {
+        memcpy(lavaLattice.slice[0], lavaLattice.slice[1], sizeof(lavaLattice.slice[0]));
+        fillLavaSlice(lavaLattice.slice[1], (z >> 8) + 1);
+    }
+    lavaZ = z;
+
+    byte zf = lavaZ & 0xff;
+    for (byte i = 0; i < LAVA_POINTS0 + LAVA_POINTS1; i++)
+    {
+        lavaLattice.current[i] = lerp8by8(lavaLattice.slice[0][i], lavaLattice.slice[1][i], zf);
+    }
+
+    const byte *lattice0 = lavaLattice.current;
+    const byte *lattice1 = lavaLattice.current + LAVA_POINTS0;
+    for (byte r = 0; r < SIM_ROWS; r++)
+    {
+        uint16_t y0 = lavaRowPos[r];
+        uint16_t y1 = y0 << 1;
+        const byte *row0 = lattice0 + (y0 >> 8) * LAVA_CELLS_X;
+        const byte *row1 = lattice1 + (y1 >> 8) * (2 * LAVA_CELLS_X);
+        for (byte c = 0; c < SIM_COLS; c++)
+        {
+            uint16_t x0 = lavaColPos[c];
+            byte n0 = lavaSample(LAVA_CELLS_X, x0, row0, y0 & 0xff);
+            byte n1 = lavaSample(2 * LAVA_CELLS_X, x0 << 1, row1, y1 & 0xff);
+            // 2/3 + 1/3 octave mix, then stretch the mid-heavy noise into blobs
+            byte v = ((uint16_t)n0 * 170 + (uint16_t)n1 * 85) >> 8;
+            v = qsub8(v, 48);
+            matrix[r][c] = qadd8(v, v >> 1);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef __have__lampParallelOutput_h__
+#define __have__lampParallelOutput_h__
+
+// Parallel WS2812 output
+// ======================
+//
+// Splits the matrix into PARALLEL_STRIPS column groups, each wired to its own
+// pin on PORTB (consecutive bits starting at PARALLEL_FIRST_BIT), and clocks
+// all of them out at once. Every strip gets a contiguous slice of leds[], so
+// the serpentine layout used by PutMatrix()/calcNextColors() is unchanged:
+// strip s drives columns [s*NUM_COLS/N, (s+1)*NUM_COLS/N).
+//
+// There is no RAM for a fully transposed frame on the ATmega328, so the
+// transposition happens inside the bit loop: each strip's channel byte sits
+// in a register and is shifted out one bit per WS2812 bit (bst/bld/lsl).
+// Between pixel slots only the next slot is staged (table lookups and three
+// scale8 per strip), and pending interrupts get a short window so millis()
+// and the input ISRs are not starved by show(). The low time of that gap is
+// measured on Timer0; if an ISR stretched it past PARALLEL_MAX_GAP_US the
+// strips may have latched a partial frame, so the whole frame is sent again
+// with interrupts kept off, as FastLED does with FASTLED_ALLOW_INTERRUPTS.
+// That needs strips with a reset time of at least 50 us, see below.
+//
+// Bit timing at 16 MHz (cycles from the rising edge):
+//   t0  all strips high
+//   t5  strips sending a 0 go low   (T0H = 5 cycles  = 312 ns)
+//   t11 all strips low              (T1H = 11 cycles = 687 ns)
+//   low phase: 4 + 3*N cycles (+ byte reload every 8 bits),
+//   so a bit period is 16 + 3*N cycles
+
+#include "globals.h"
+#include <FastLED.h>
+
+#if PARALLEL_STRIPS > 0
+
+#if PARALLEL_STRIPS < 2 || (PARALLEL_FIRST_BIT + PARALLEL_STRIPS) > 6
+#error "PARALLEL_STRIPS must be 2..6 and fit into PB0..PB5"
+#endif
+
+#define PAR_STR2(x) #x
+#define PAR_STR(x) PAR_STR2(x)
+
+#define PAR_LOAD(n) "ld %[s" #n "], %a[ptr]+        \n\t"
+#define PAR_BIT(n)                                          \
+    "bst %[s" #n "], 7                             \n\t"    \
+    "bld %[cur], " PAR_STR(PARALLEL_FIRST_BIT) "+" #n " \n\t" \
+    "lsl %[s" #n "]                                \n\t"
+
+#if PARALLEL_STRIPS == 2
+#define PAR_LOADS PAR_LOAD(0) PAR_LOAD(1)
+#define PAR_BITS PAR_BIT(0) PAR_BIT(1)
+#elif PARALLEL_STRIPS == 3
+#define PAR_LOADS PAR_LOAD(0) PAR_LOAD(1) PAR_LOAD(2)
+#define PAR_BITS PAR_BIT(0) PAR_BIT(1) PAR_BIT(2)
+#elif PARALLEL_STRIPS == 4
+#define PAR_LOADS PAR_LOAD(0) PAR_LOAD(1) PAR_LOAD(2) PAR_LOAD(3)
+#define PAR_BITS PAR_BIT(0) PAR_BIT(1) PAR_BIT(2) PAR_BIT(3)
+#elif PARALLEL_STRIPS == 5
+#define PAR_LOADS PAR_LOAD(0) PAR_LOAD(1) PAR_LOAD(2) PAR_LOAD(3) PAR_LOAD(4)
+#define PAR_BITS PAR_BIT(0) PAR_BIT(1) PAR_BIT(2) PAR_BIT(3) PAR_BIT(4)
+#else
+#define PAR_LOADS PAR_LOAD(0) PAR_LOAD(1) PAR_LOAD(2) PAR_LOAD(3) PAR_LOAD(4) PAR_LOAD(5)
+#define PAR_BITS PAR_BIT(0) PAR_BIT(1) PAR_BIT(2) PAR_BIT(3) PAR_BIT(4) PAR_BIT(5)
+#endif
+
+// Longest low time between two pixel slots before the frame is resent. Even
+// without interrupts, staging a slot keeps the line low for ~10 us, so only
+// strips with a reset time of 50 us or more are supported (WS2812B, SK6812;
+// not early WS2812 parts that latch after 6..9 us).
+#define PARALLEL_MAX_GAP_US 40
+
+const uint8_t parallelMask = ((1 << PARALLEL_STRIPS) - 1) << PARALLEL_FIRST_BIT;
+
+// strip s drives leds[parallelStart[s] .. parallelStart[s+1]),
+// entries past PARALLEL_STRIPS are unused
+#define PAR_START(s) ((((s) * NUM_COLS) / PARALLEL_STRIPS) * NUM_ROWS)
+const uint16_t parallelStart[7] = {PAR_START(0), PAR_START(1), PAR_START(2), PAR_START(3),
+                                   PAR_START(4), PAR_START(5), PAR_START(6)};
+
+unsigned long parallelLastShow = 0;
+
+void parallelBegin()
+{
+    DDRB |= parallelMask;
+    PORTB &= ~parallelMask;
+}
+
+// Sends one pixel slot: 3 channel bytes for every strip, channel-major
+// (G of all strips, then R, then B). Must be called with interrupts off.
+inline void parallelSendSlot(const uint8_t *px, uint8_t hi, uint8_t lo)
+{
+    uint8_t s0, s1, s2, s3, s4, s5, cur, bit, ch;
+    asm volatile(
+        "ldi %[ch], 3                 \n\t"
+        "1:                           \n\t"
+        PAR_LOADS
+        "ldi %[bit], 8                \n\t"
+        "mov %[cur], %[lo]            \n\t"
+        PAR_BITS
+        "2:                           \n\t"
+        "out %[port], %[hi]           \n\t" // t0
+        "nop \n\t nop \n\t nop \n\t nop \n\t"
+        "out %[port], %[cur]          \n\t" // t5
+        "nop \n\t nop \n\t nop \n\t nop \n\t nop \n\t"
+        "out %[port], %[lo]           \n\t" // t11
+        "mov %[cur], %[lo]            \n\t"
+        PAR_BITS
+        "dec %[bit]                   \n\t"
+        "brne 2b                      \n\t"
+        "dec %[ch]                    \n\t"
+        "brne 1b                      \n\t"
+        : [s0] "=&r"(s0), [s1] "=&r"(s1), [s2] "=&r"(s2), [s3] "=&r"(s3),
+          [s4] "=&r"(s4), [s5] "=&r"(s5), [cur] "=&r"(cur),
+          [bit] "=&d"(bit), [ch] "=&d"(ch), [ptr] "+e"(px)
+        : [port] "I"(_SFR_IO_ADDR(PORTB)), [hi] "r"(hi), [lo] "r"(lo)
+        : "memory");
+}
+
+// scaled GRB bytes of pixel slot i for every strip, strips that are
+// already done send black
+inline void parallelStage(uint8_t *px, uint16_t i, const CRGB &adj)
+{
+    for (uint8_t s = 0; s < PARALLEL_STRIPS; s++)
+    {
+        if (i < (uint16_t)(parallelStart[s + 1] - parallelStart[s]))
+        {
+            const CRGB &p = leds[parallelStart[s] + i];
+            px[s] = scale8(p.g, adj.g);
+            px[PARALLEL_STRIPS + s] = scale8(p.r, adj.r);
+            px[2 * PARALLEL_STRIPS + s] = scale8(p.b, adj.b);
+        }
+        else
+        {
+            px[s] = px[PARALLEL_STRIPS + s] = px[2 * PARALLEL_STRIPS + s] = 0;
+        }
+    }
+}
+
+void parallelShow()
+{
+    // brightness, power limit and color correction, as FastLED.show() applies them
+    uint8_t scale = calculate_max_brightness_for_power_vmA(leds, NUM_LEDS, FastLED.getBrightness(), 5, PSU_MAX_MAMPS);
+    CRGB adj = CLEDController::computeAdjustment(scale, TypicalLEDStrip, UncorrectedTemperature);
+
+    const uint16_t maxLen = ((NUM_COLS + PARALLEL_STRIPS - 1) / PARALLEL_STRIPS) * NUM_ROWS;
+    uint8_t px[3 * PARALLEL_STRIPS];
+
+    uint8_t sreg = SREG;
+    uint8_t irqWindow = sreg & (1 << SREG_I);
+    uint8_t overrun;
+    do
+    {
+        // latch time of the previous (or aborted) frame
+        while ((micros() - parallelLastShow) < 60)
+            ;
+
+        cli();
+        uint8_t lo = PORTB & ~parallelMask;
+        uint8_t hi = lo | parallelMask;
+
+        overrun = 0;
+        parallelStage(px, 0, adj);
+        for (uint16_t i = 0; i < maxLen; i++)
+        {
+            parallelSendSlot(px, hi, lo);
+            uint8_t gapStart = TCNT0; // Timer0 runs at 4 us per tick (16 MHz / 64)
+
+            if (irqWindow)
+            {
+                sei();
+                asm volatile("nop");
+                cli();
+            }
+            if (i + 1 < maxLen)
+            {
+                parallelStage(px, i + 1, adj);
+            }
+
+            if ((uint8_t)(TCNT0 - gapStart) > PARALLEL_MAX_GAP_US / 4)
+            {
+                // an ISR ran too long, resend the frame without interrupt windows
+                overrun = 1;
+                irqWindow = 0;
+                break;
+            }
+        }
+
+        SREG = sreg;
+        parallelLastShow = micros();
+    } while (overrun);
+}
+
+#endif
+
+#endif
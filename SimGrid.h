@@ -0,0 +1,59 @@
+#ifndef __have__lampSimGrid_h__
+#define __have__lampSimGrid_h__
+
+// Simulation grid
+// ===============
+//
+// Fire2012, the torch and lava simulate on SIM_ROWS x SIM_COLS cells in the
+// top-left corner of matrix[]. With SIM_SCALE > 1 that grid is smaller than
+// the LED matrix, and sampleMatrix() interpolates it back up (8.8 fixed
+// point bilinear) while the LEDs are being mapped. Rows are aligned at the
+// bottom and top cells; columns go around the cylinder, so the last column
+// blends into the first one. The per-row and per-column positions are
+// computed once in initSimGrid().
+
+#include "globals.h"
+#include <FastLED.h>
+
+#if SIM_SCALE != 1 && SIM_SCALE != 2 && SIM_SCALE != 4
+#error "SIM_SCALE must be 1, 2 or 4"
+#endif
+
+#if SIM_SCALE > 1
+uint16_t simRowPos[NUM_ROWS];
+uint16_t simColPos[NUM_COLS];
+#endif
+
+void initSimGrid()
+{
+#if SIM_SCALE > 1
+    for (byte r = 0; r < NUM_ROWS; r++)
+    {
+        simRowPos[r] = ((uint32_t)r * ((SIM_ROWS - 1) << 8)) / (NUM_ROWS - 1);
+    }
+    for (byte c = 0; c < NUM_COLS; c++)
+    {
+        simColPos[c] = ((uint32_t)c * (SIM_COLS << 8)) / NUM_COLS;
+    }
+#endif
+}
+
+// simulated value at LED row r, column c
+inline byte sampleMatrix(byte r, byte c)
+{
+#if SIM_SCALE > 1
+    byte yi = simRowPos[r] >> 8;
+    byte yf = simRowPos[r] & 0xff;
+    byte xi = simColPos[c] >> 8;
+    byte xf = simColPos[c] & 0xff;
+    byte yn = yf ? yi + 1 : yi;
+    byte xn = (xi + 1 == SIM_COLS) ? 0 : xi + 1;
+    byte top = lerp8by8(matrix[yi][xi], matrix[yi][xn], xf);
+    byte bottom = lerp8by8(matrix[yn][xi], matrix[yn][xn], xf);
+    return lerp8by8(top, bottom, yf);
+#else
+    return matrix[r][c];
+#endif
+}
+
+#endif
@@ -25,6 +25,7 @@
 // torch parameters
 
 #include "globals.h"
+#include "SimGrid.h"
 #include <FastLED.h>
 
 byte flame_min = 100; // 0..255
@@ -130,9 +131,12 @@ void resetEnergy( )
 
 void calcNextEnergy()
 {
-    for (byte x = 0; x < NUM_COLS; x++)
+    for (byte x = 0; x < SIM_COLS; x++)
     {
-        for (byte y = 0; y < NUM_ROWS; y++)  
+        // side neighbours around the cylinder, within the simulated columns
+        byte xl = x ? x - 1 : SIM_COLS - 1;
+        byte xr = (x + 1 < SIM_COLS) ? x + 1 : 0;
+        for (byte y = 0; y < SIM_ROWS; y++)  
         {
             byte e = matrix[y][x]; 
             byte m = getEnergyBitMode(y,x); //energyMode[y][x];
@@ -143,7 +147,7 @@ void calcNextEnergy()
                 // loose transfer up energy as long as the is any
                 reduce(e, spark_tfr);
                 // cell above is temp spark, sucking up energy from this cell until empty
-                if (y < NUM_ROWS - 1)
+                if (y < SIM_ROWS - 1)
                 {
                     putEnergyBitMode(y + 1, x, torch_spark_temp); //energyMode[y+1][x] = torch_spark_temp;
                 }
@@ -174,7 +178,7 @@ void calcNextEnergy()
             {
                 e = ((int)e * heat_cap) >> 8;
 //                 increase(e, ((((int)currentEnergy[i - 1] + (int)currentEnergy[i + 1]) * side_rad) >> 9) + (((int)currentEnergy[i - NUM_COLS] * up_rad) >> 8));
-                increase(e, ((((int)matrix[y][x-1] + (int)matrix[y][x+1]) * side_rad) >> 9) + (((int)matrix[y-1][x] * up_rad) >> 8));
+                increase(e, ((((int)matrix[y][xl] + (int)matrix[y][xr]) * side_rad) >> 9) + (((int)matrix[y-1][x] * up_rad) >> 8));
             }
             default:
                 break;
@@ -196,6 +200,15 @@ void calcNextColors( )
 {
     int ei = 0; // index in led
     int ee = 0;
+#if SIM_SCALE > 1
+    for (byte y = 0; y < SIM_ROWS; y++)
+    {
+        for (byte x = 0; x < SIM_COLS; x++)
+        {
+            matrix[y][x] = nextEnergy[y][x];
+        }
+    }
+#endif
     for (byte x = 0; x < NUM_COLS; x++)
     {
         for (byte y = 0; y < NUM_ROWS; y++)
@@ -214,8 +227,12 @@ void calcNextColors( )
                 ee = ei - y + (NUM_ROWS - 1) - y;
             }
 
+#if SIM_SCALE > 1
+            uint16_t e = sampleMatrix(yi, x);
+#else
             uint16_t e = nextEnergy[yi][x];
             matrix[yi][x] = e; // currentEnergy[ei] = e;
+#endif
 
             if (e > 250)
 //                leds[ee] = CRGB(170, 170, e); // blueish extra-bright spark
@@ -250,14 +267,14 @@ void calcNextColors( )
 void injectRandom()
 {
     // random flame energy at bottom row
-    for (byte x = 0; x < NUM_COLS; x++)
+    for (byte x = 0; x < SIM_COLS; x++)
     {
 //        currentEnergy[i] = random2(flame_min, flame_max);
         matrix[0][x] = random2(flame_min, flame_max);
         putEnergyBitMode(0,x,torch_nop);  //  energyMode[0][x] = torch_nop;
     }
     // random sparks at second row
-    for (byte x = 0; x < NUM_COLS; x++)
+    for (byte x = 0; x < SIM_COLS; x++)
     {
 //        if (energyMode[1][x] != torch_spark && random2(100) < random_spark_probability)
         if (getEnergyBitMode(1, x) != torch_spark && random2(100) < random_spark_probability)
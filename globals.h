@@ -2,10 +2,19 @@
 #define __have__lampGlobals_h__
 
 #define DEBUG_OUTPUT 1
+// stream every frame over serial as raw binary instead of the debug text
+//#define FRAME_STREAM 1
+// time the rendering kernels once at startup and print the results as JSON
+//#define KERNEL_BENCH 1
 #define EEPROM_SETTINGS  1
 #define NUM_ROWS 15
 #define NUM_COLS 14
 #define NUM_LEDS (NUM_ROWS * NUM_COLS)
+// 1: Fire2012/torch/lava simulate one cell per LED, 2 or 4: on a reduced
+// grid that is interpolated up when mapped to the LEDs (see SimGrid.h)
+#define SIM_SCALE 1
+#define SIM_ROWS ((NUM_ROWS + SIM_SCALE - 1) / SIM_SCALE)
+#define SIM_COLS ((NUM_COLS + SIM_SCALE - 1) / SIM_SCALE)
 #define FRAMES_PER_SECOND 60
 
 byte matrix[NUM_ROWS][NUM_COLS];